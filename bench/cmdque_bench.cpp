@@ -0,0 +1,357 @@
+// ----------------------------------------------------------------------------
+//
+// Push and pop latency of the command queue with several producers, the way
+// libspotify callbacks, client threads and observers push at the spotify
+// thread. The mutex/condition variable queue it replaced is measured next to
+// it for comparison. Last the latency of interactive commands while a large
+// import runs in the bulk lane, and how late timers run under load.
+//
+//   rake bench && ./build/cmdque_bench [producers] [commands-per-producer]
+//
+// ----------------------------------------------------------------------------
+#include <cmdque.h>
+// ----------------------------------------------------------------------------
+#include <algorithm>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <mutex>
+#include <new>
+#include <queue>
+#include <thread>
+#include <vector>
+// ----------------------------------------------------------------------------
+#include <sys/resource.h>
+// ----------------------------------------------------------------------------
+
+//
+// Allocation counting
+//
+
+static std::atomic<size_t> allocations(0);
+
+void* operator new(size_t size)
+{
+  allocations++;
+  void* p = std::malloc(size ? size : 1);
+  if ( !p ) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void operator delete(void* p) noexcept
+{
+  std::free(p);
+}
+
+// ----------------------------------------------------------------------------
+
+// The queue as it was, a std::queue behind a mutex.
+class locked_cmdque_t
+{
+public:
+  void push(std::function<void()>&& command)
+  {
+    std::lock_guard<std::mutex> _(lock);
+    q.push(std::move(command));
+    rdy.notify_all();
+  }
+public:
+  std::function<void()> pop(std::chrono::milliseconds wait_for, std::function<void()> timeout_cb=[]{})
+  {
+    std::unique_lock<std::mutex> _(lock);
+
+    if ( q.empty() )
+    {
+      rdy.wait_for(_, wait_for);
+    }
+
+    if ( q.empty() )
+    {
+      return timeout_cb;
+    }
+    else
+    {
+      std::function<void()> command = std::move(q.front());
+      q.pop();
+      return command;
+    }
+  }
+private:
+  std::mutex lock;
+  std::condition_variable rdy;
+  std::queue<std::function<void()>> q;
+};
+
+// ----------------------------------------------------------------------------
+using bench_clock = std::chrono::steady_clock;
+
+static long long nanoseconds(bench_clock::duration d)
+{
+  return std::chrono::duration_cast<std::chrono::nanoseconds>(d).count();
+}
+
+static long long percentile(std::vector<long long>& v, double p)
+{
+  size_t i = std::min(v.size()-1, static_cast<size_t>(p*v.size()));
+  std::nth_element(v.begin(), v.begin()+i, v.end());
+  return v[i];
+}
+
+// Context switches of the calling thread so far.
+static long context_switches()
+{
+  rusage usage;
+  getrusage(RUSAGE_THREAD, &usage);
+  return usage.ru_nvcsw + usage.ru_nivcsw;
+}
+
+// The consumer loop, one command per pop or batches from drain.
+template <class Q>
+static void consume(Q& q, bool& done, size_t)
+{
+  while ( !done ) {
+    q.pop(std::chrono::milliseconds(100))();
+  }
+}
+
+static void consume(cmdque_t& q, bool& done, size_t batch_size)
+{
+  if ( batch_size == 0 )
+  {
+    while ( !done ) {
+      q.pop(std::chrono::milliseconds(100))();
+    }
+    return;
+  }
+
+  std::vector<command_t> batch;
+  batch.reserve(batch_size);
+
+  while ( !done )
+  {
+    q.drain(batch, batch_size, std::chrono::milliseconds(100));
+    for ( auto& command : batch ) {
+      command();
+    }
+  }
+}
+
+// Producers push as fast as they can, or with a pause after each push so
+// the queue is mostly empty and the consumer parks in between.
+template <class Q>
+static void run(const char* name, size_t producers, size_t commands, std::chrono::microseconds pause, size_t batch_size = 0)
+{
+  Q q;
+
+  size_t total = producers*commands;
+
+  // Filled in by the consumer, time from push to the command running.
+  std::vector<long long> latency;
+  latency.reserve(total);
+
+  // Next command the consumer should see from each producer.
+  std::vector<size_t> expected(producers, 0);
+
+  // Filled in by each producer, time spent in push.
+  std::vector<std::vector<long long>> push_times(producers);
+
+  // Warm up the pools and let the threads get going before counting.
+  for ( int i = 0; i < 1000; i++ ) {
+    q.push([]() {});
+  }
+
+  bool done = false;
+  long switches = 0;
+  std::thread consumer([&]()
+  {
+    long before = context_switches();
+    consume(q, done, batch_size);
+    switches = context_switches()-before;
+  });
+
+  auto start = bench_clock::now();
+  size_t allocated = allocations;
+
+  std::vector<std::thread> threads;
+  for ( size_t p = 0; p < producers; p++ )
+  {
+    threads.emplace_back([&, p]()
+    {
+      auto& times = push_times[p];
+      times.reserve(commands);
+
+      for ( size_t i = 0; i < commands; i++ )
+      {
+        // Captures 40 bytes, more than std::function keeps in place.
+        auto t0 = bench_clock::now();
+        q.push([&latency, &expected, t0, p, i]()
+        {
+          latency.push_back(nanoseconds(bench_clock::now()-t0));
+          if ( expected[p]++ != i ) {
+            std::fprintf(stderr, "commands from producer %zu out of order\n", p);
+            std::abort();
+          }
+        });
+        times.push_back(nanoseconds(bench_clock::now()-t0));
+
+        if ( pause.count() > 0 ) {
+          std::this_thread::sleep_for(pause);
+        }
+      }
+    });
+  }
+
+  for ( auto& t : threads ) {
+    t.join();
+  }
+  q.push([&]() { done = true; });
+  consumer.join();
+
+  double elapsed = nanoseconds(bench_clock::now()-start)/1e9;
+  double allocs = double(allocations-allocated)/total;
+
+  std::vector<long long> push;
+  for ( auto& times : push_times ) {
+    push.insert(push.end(), times.begin(), times.end());
+  }
+
+  std::printf("%-6s %-8s %8.0f kcmd/s %5.2f allocs/cmd %6.1f cs/kcmd   push p50 %6lld p99 %7lld max %9lld ns   latency p50 %9lld p99 %9lld ns\n",
+    pause.count() > 0 ? "paced" : "flood", name, total/elapsed/1000, allocs, 1000.0*switches/total,
+    percentile(push, 0.5), percentile(push, 0.99), *std::max_element(push.begin(), push.end()),
+    percentile(latency, 0.5), percentile(latency, 0.99));
+}
+
+// A playlist import, bulk commands of about 20us each, with a skip pushed
+// every millisecond meanwhile. Reports how long the skips waited, with the
+// skips in their own lane or in the same lane as the import.
+static void run_import(const char* name, cmdque_t::lane_t skip_lane)
+{
+  cmdque_t q;
+
+  const size_t imports = 50000;
+
+  std::vector<long long> latency;
+  latency.reserve(imports);
+
+  std::atomic<bool> imported(false);
+  bool done = false;
+
+  std::thread consumer([&]()
+  {
+    while ( !done ) {
+      q.pop(std::chrono::milliseconds(100))();
+    }
+  });
+
+  for ( size_t i = 0; i < imports; i++ )
+  {
+    q.push(cmdque_t::lane_t::bulk, [&imported, i]()
+    {
+      auto until = bench_clock::now() + std::chrono::microseconds(20);
+      while ( bench_clock::now() < until ) {
+      }
+      if ( i+1 == imports ) {
+        imported = true;
+      }
+    });
+  }
+
+  while ( !imported )
+  {
+    auto t0 = bench_clock::now();
+    q.push(skip_lane, [&latency, t0]() { latency.push_back(nanoseconds(bench_clock::now()-t0)); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(1));
+  }
+
+  q.push(cmdque_t::lane_t::bulk, [&]() { done = true; });
+  consumer.join();
+
+  std::printf("import %-12s %6zu skips   latency p50 %9lld p99 %9lld max %9lld ns\n",
+    name, latency.size(), percentile(latency, 0.5), percentile(latency, 0.99),
+    *std::max_element(latency.begin(), latency.end()));
+}
+
+// A timer that reschedules itself every 5ms in the realtime lane, the way
+// the spotify thread calls sp_session_process_events, while 20us bulk
+// commands keep the consumer busy. Reports how late the timer ran.
+static void run_timer_under_load()
+{
+  cmdque_t q;
+
+  const size_t ticks = 400;
+
+  std::vector<long long> lateness;
+  lateness.reserve(ticks);
+
+  bool done = false;
+  std::function<void(cmdque_t::clock::time_point)> tick = [&](cmdque_t::clock::time_point due)
+  {
+    lateness.push_back(nanoseconds(cmdque_t::clock::now()-due));
+    if ( lateness.size() == ticks )
+    {
+      done = true;
+      return;
+    }
+    auto next = due + std::chrono::milliseconds(5);
+    q.schedule(next, cmdque_t::lane_t::realtime, [&tick, next]() { tick(next); });
+  };
+
+  std::atomic<bool> loading(true);
+  std::thread producer([&]()
+  {
+    while ( loading )
+    {
+      for ( int i = 0; i < 100; i++ )
+      {
+        q.push(cmdque_t::lane_t::bulk, []()
+        {
+          auto until = bench_clock::now() + std::chrono::microseconds(20);
+          while ( bench_clock::now() < until ) {
+          }
+        });
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+  });
+
+  q.push(cmdque_t::lane_t::realtime, [&]() { tick(cmdque_t::clock::now()); });
+
+  while ( !done ) {
+    q.pop(std::chrono::milliseconds(100))();
+  }
+
+  loading = false;
+  producer.join();
+
+  std::printf("timer  under load   %6zu ticks   late p50 %9lld p99 %9lld max %9lld ns\n",
+    lateness.size(), percentile(lateness, 0.5), percentile(lateness, 0.99),
+    *std::max_element(lateness.begin(), lateness.end()));
+}
+
+int main(int argc, char* argv[])
+{
+  size_t producers = argc > 1 ? std::atoi(argv[1]) : 8;
+  size_t commands = argc > 2 ? std::atoi(argv[2]) : 100000;
+
+  std::printf("%zu producers, %zu commands each, %u cores\n", producers, commands, std::thread::hardware_concurrency());
+
+  for ( auto pause : { std::chrono::microseconds(0), std::chrono::microseconds(50) } )
+  {
+    size_t n = pause.count() > 0 ? commands/10 : commands;
+    for ( int i = 0; i < 3; i++ )
+    {
+      run<locked_cmdque_t>("locked", producers, n, pause);
+      run<cmdque_t>("cmdque", producers, n, pause);
+      run<cmdque_t>("drain", producers, n, pause, 16);
+    }
+  }
+
+  run_import("same-lane", cmdque_t::lane_t::bulk);
+  run_import("interactive", cmdque_t::lane_t::interactive);
+  run_timer_under_load();
+  return 0;
+}
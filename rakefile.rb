@@ -38,12 +38,20 @@ spec = Rake::ExecutableSpecification.new do |s|
         source/**/*.cpp
         source/appkey.c
     )
-    s.libraries += [ popt, json ] + %w(asound b64 spotify)
+    s.libraries += [ popt, json ] + %w(asound spotify)
 end
 
 # -----------------------------------------------------------------------------
 Rake::ExecutableTask.new(:spotihifid, spec)
 
+# -----------------------------------------------------------------------------
+file "build/cmdque_bench" => [ "bench/cmdque_bench.cpp", "source/cmdque.h" ] do |t|
+    mkdir_p "build"
+    sh "g++ -std=c++11 -Wall -O2 -pthread -Isource -o#{t.name} #{t.prerequisites[0]}"
+end
+
+task :bench => [ "build/cmdque_bench" ]
+
 # -----------------------------------------------------------------------------
 CLEAN.include('build')
 # -----------------------------------------------------------------------------
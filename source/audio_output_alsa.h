@@ -13,6 +13,7 @@
 
 // ----------------------------------------------------------------------------
 #include <cmdque.h>
+#include <slab_pool.h>
 #include <log.h>
 
 // ----------------------------------------------------------------------------
@@ -22,6 +23,8 @@
 #include <thread>
 #include <atomic>
 #include <string>
+#include <vector>
+#include <functional>
 
 // ----------------------------------------------------------------------------
 #include <alsa/asoundlib.h>
@@ -29,6 +32,18 @@
 // ----------------------------------------------------------------------------
 class audio_output_t
 {
+public:
+  // Frames taken per write, the rest is left for libspotify to deliver
+  // again. Buffers come from a pool so playback doesn't allocate.
+  static const size_t buffer_frames = 2048;
+  static const size_t command_batch_size = 16;
+private:
+  using buffer_pool = slab_pool_t<buffer_frames*sizeof(int16_t)*2>;
+  struct buffer_deleter_t
+  {
+    void operator()(char* p) const { buffer_pool::deallocate(p); }
+  };
+  using buffer_ptr = std::unique_ptr<char, buffer_deleter_t>;
 public:
   audio_output_t(const std::string& device_name)
     :
@@ -49,18 +64,23 @@ public:
     m_thr.join();
   }
 public:
-  void write_s16_le_i(const void* frames, size_t num_frames)
+  // Returns the number of frames taken.
+  size_t write_s16_le_i(const void* frames, size_t num_frames)
   {
+    if ( num_frames > buffer_frames ) {
+      num_frames = buffer_frames;
+    }
+
     size_t len = num_frames * sizeof(int16_t) * 2 /* channels */;
-    std::shared_ptr<char> buffer(new char[len], std::default_delete<char[]>());
+    buffer_ptr buffer(static_cast<char*>(buffer_pool::allocate()));
 
     std::memcpy(buffer.get(), frames, len);
 
-    m_command_queue.push([=]{
-      write_s16_le_i_handler(std::move(buffer), num_frames);
-    });
+    m_command_queue.push(std::bind(&audio_output_t::write_s16_le_i_handler, this, std::move(buffer), num_frames));
 
     m_queued_frames += num_frames;
+
+    return num_frames;
   }
 public:
   void stop()
@@ -100,7 +120,7 @@ private:
     }
   }
 private:
-  void write_s16_le_i_handler(std::shared_ptr<char> buf, size_t num_frames)
+  void write_s16_le_i_handler(const buffer_ptr& buf, size_t num_frames)
   {
     snd_pcm_sframes_t frames = snd_pcm_writei(m_handle, buf.get(), num_frames);
 
@@ -120,10 +140,22 @@ private:
   void main()
   {
     init();
+
+    // Chunks that queued up while snd_pcm_writei blocked are written in
+    // one go.
+    std::vector<command_t> batch;
+    batch.reserve(command_batch_size);
+
     while ( m_running )
     {
-      auto cmd = m_command_queue.pop(std::chrono::seconds(1));
-      cmd();
+      m_command_queue.drain(batch, command_batch_size, std::chrono::seconds(1));
+      for ( auto& cmd : batch )
+      {
+        cmd();
+        if ( !m_running ) {
+          break;
+        }
+      }
     }
 
     if (m_handle) {
@@ -6,23 +6,162 @@
 //
 // --- Description: -----------------------------------------------------------
 //
+// Multi producer, single consumer command queue. Producers link a node in
+// with one atomic exchange and never wait for each other or the consumer.
+// The consumer parks on a futex when the queue is empty and is woken by the
+// first push after it went to sleep. Nodes come from a slab pool and hold
+// the command in place, so a push of a small command doesn't touch the heap.
+// Commands are pushed to one of a few priority lanes, each lane is FIFO.
+// The consumer can also schedule commands for later, they are kept in a
+// min-heap by deadline and moved to their lane when due.
 //
 // ----------------------------------------------------------------------------
 #ifndef __cmdque_h__
 #define __cmdque_h__
 
 // ----------------------------------------------------------------------------
-#include <queue>
-#include <mutex>
-#include <condition_variable>
-#include <functional>
+#include <command.h>
+#include <slab_pool.h>
+
+// ----------------------------------------------------------------------------
+#include <atomic>
+#include <chrono>
+#include <thread>
+#include <vector>
+#include <algorithm>
 #include <iostream>
 
+// ----------------------------------------------------------------------------
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#include <time.h>
+
 // ----------------------------------------------------------------------------
 class cmdque_t
 {
 public:
-  cmdque_t()
+  // Lanes in the order they are served. A lane that has been passed over
+  // while holding commands starvation_limit times in a row gets the next
+  // turn, so bulk work moves on even when the other lanes are busy.
+  enum class lane_t { realtime, interactive, bulk };
+  static const size_t lanes = 3;
+  static const unsigned starvation_limit = 8;
+public:
+  using clock = std::chrono::steady_clock;
+  // Identifies a scheduled command, 0 is never used.
+  typedef unsigned long long timer_id_t;
+private:
+  struct node_t
+  {
+    node_t() : next(nullptr)
+    {
+    }
+    template <typename F> explicit node_t(F&& f) : next(nullptr), command(std::forward<F>(f))
+    {
+    }
+    static void* operator new(size_t)
+    {
+      return pool::allocate();
+    }
+    static void operator delete(void* p)
+    {
+      pool::deallocate(p);
+    }
+    std::atomic<node_t*> next;
+    command_t command;
+  };
+  using pool = slab_pool_t<sizeof(node_t)>;
+  enum class pop_result_t { popped, empty, busy };
+  struct timer_entry_t
+  {
+    clock::time_point when;
+    timer_id_t id;
+    lane_t lane;
+    node_t* node;
+  public:
+    // Orders the heap with the earliest deadline on top.
+    bool operator< (const timer_entry_t& rhs) const
+    {
+      return when > rhs.when || ( when == rhs.when && id > rhs.id );
+    }
+  };
+private:
+  // The commands of one lane, a linked list with a stub node that producers
+  // append to at m_head and the consumer takes from at m_tail.
+  class lane_queue_t
+  {
+  public:
+    lane_queue_t() : m_head(&m_stub), m_tail(&m_stub)
+    {
+    }
+    ~lane_queue_t()
+    {
+      node_t* n = m_tail;
+      while ( n )
+      {
+        node_t* next = n->next.load(std::memory_order_relaxed);
+        if ( n != &m_stub ) {
+          delete n;
+        }
+        n = next;
+      }
+    }
+  public:
+    void enqueue(node_t* n)
+    {
+      n->next.store(nullptr, std::memory_order_relaxed);
+      node_t* prev = m_head.exchange(n);
+      prev->next.store(n, std::memory_order_release);
+    }
+  public:
+    // Consumer only. Whether there is a command to take, a push half way
+    // through doesn't count.
+    bool ready() const
+    {
+      return m_tail != &m_stub || m_stub.next.load(std::memory_order_acquire);
+    }
+  public:
+    pop_result_t try_pop(command_t& command)
+    {
+      node_t* tail = m_tail;
+      node_t* next = tail->next.load(std::memory_order_acquire);
+
+      if ( tail == &m_stub )
+      {
+        if ( !next ) {
+          return m_head.load() == tail ? pop_result_t::empty : pop_result_t::busy;
+        }
+        m_tail = next;
+        tail = next;
+        next = next->next.load(std::memory_order_acquire);
+      }
+
+      if ( !next )
+      {
+        if ( m_head.load() != tail ) {
+          return pop_result_t::busy;
+        }
+        // tail is the last node, put the stub behind it so it can be taken.
+        enqueue(&m_stub);
+        next = tail->next.load(std::memory_order_acquire);
+        if ( !next ) {
+          return pop_result_t::busy;
+        }
+      }
+
+      m_tail = next;
+      command = std::move(tail->command);
+      delete tail;
+      return pop_result_t::popped;
+    }
+  private:
+    node_t m_stub;
+    std::atomic<node_t*> m_head;
+    node_t* m_tail;
+  };
+public:
+  cmdque_t() : m_lanes(), m_passed(), m_timers(), m_next_timer_id(1), m_sleeping(0)
   {
   };
 private:
@@ -30,40 +169,226 @@ private:
 public:
   virtual ~cmdque_t()
   {
+    for ( auto& t : m_timers ) {
+      delete t.node;
+    }
   };
 public:
-  void push(std::function<void()>&& command)
+  // Safe to call from any thread. Takes a command_t or anything a command_t
+  // can be made from, the command is built in place in the node.
+  template <typename F> void push(lane_t lane, F&& command)
+  {
+    m_lanes[static_cast<size_t>(lane)].enqueue(new node_t(std::forward<F>(command)));
+
+    // The exchange in enqueue and this load, and the store of m_sleeping
+    // and the load of m_head in pop, are all sequentially consistent. So
+    // either the consumer sees the node or we see that it went to sleep.
+    if ( m_sleeping.load() && m_sleeping.exchange(0) ) {
+      futex_wake(&m_sleeping);
+    }
+  }
+  // Queues with a single kind of work use the interactive lane.
+  template <typename F> void push(F&& command)
+  {
+    push(lane_t::interactive, std::forward<F>(command));
+  }
+public:
+  // Only from the consumer thread. Push command to lane at when, or as soon
+  // as possible if when has passed.
+  template <typename F> timer_id_t schedule(clock::time_point when, lane_t lane, F&& command)
   {
-    std::lock_guard<std::mutex> _(lock);
-    q.push(std::move(command));
-    rdy.notify_all();
+    timer_id_t id = m_next_timer_id++;
+
+    m_timers.push_back(timer_entry_t{when, id, lane, new node_t(std::forward<F>(command))});
+    std::push_heap(m_timers.begin(), m_timers.end());
+
+    return id;
+  }
+  template <typename F> timer_id_t schedule(std::chrono::milliseconds after, lane_t lane, F&& command)
+  {
+    return schedule(clock::now()+after, lane, std::forward<F>(command));
+  }
+public:
+  // Only from the consumer thread. False if the timer has been pushed
+  // already or was cancelled before.
+  bool cancel(timer_id_t id)
+  {
+    for ( size_t i = 0; i < m_timers.size(); i++ )
+    {
+      if ( m_timers[i].id == id )
+      {
+        delete m_timers[i].node;
+        m_timers[i] = m_timers.back();
+        m_timers.pop_back();
+        std::make_heap(m_timers.begin(), m_timers.end());
+        return true;
+      }
+    }
+    return false;
   }
 public:
-  std::function<void()> pop(std::chrono::milliseconds wait_for, std::function<void()> timeout_cb=[]{})
-  //std::function<void()> pop()
+  // Only from the consumer thread. Returns timeout_cb if nothing was pushed
+  // within wait_for, an empty command that does nothing without one.
+  command_t pop(std::chrono::milliseconds wait_for)
   {
-    std::unique_lock<std::mutex> _(lock);
+    return pop(wait_for, command_t());
+  }
+  template <typename F> command_t pop(std::chrono::milliseconds wait_for, F&& timeout_cb)
+  {
+    auto deadline = clock::now() + wait_for;
+    command_t command;
 
-    if ( q.empty() )
+    for ( ;; )
     {
-      rdy.wait_for(_, wait_for);
+      if ( !m_timers.empty() ) {
+        push_due_timers(clock::now());
+      }
+
+      switch ( try_pop(command) )
+      {
+        case pop_result_t::popped:
+          m_sleeping.store(0, std::memory_order_relaxed);
+          return command;
+        case pop_result_t::busy:
+          // A producer is half way through a push.
+          std::this_thread::yield();
+          continue;
+        case pop_result_t::empty:
+          break;
+      }
+
+      if ( !m_sleeping.load(std::memory_order_relaxed) )
+      {
+        // Say we are going to sleep, then look once more.
+        m_sleeping.store(1);
+        continue;
+      }
+
+      auto now = clock::now();
+      if ( now >= deadline )
+      {
+        m_sleeping.store(0, std::memory_order_relaxed);
+        return command_t(std::forward<F>(timeout_cb));
+      }
+
+      auto wake = deadline;
+      if ( !m_timers.empty() )
+      {
+        wake = std::min(wake, m_timers.front().when);
+        if ( wake <= now ) {
+          continue;
+        }
+      }
+
+      // Returns at once if a push has cleared m_sleeping already.
+      futex_wait(&m_sleeping, 1, wake-now);
     }
+  }
+public:
+  // Only from the consumer thread. Waits like pop, then takes what else is
+  // ready without waiting, up to max_n commands in all, in the order pop
+  // would return them. Commands that come in meanwhile wait for the batch
+  // to finish whatever their lane, keep max_n small. batch is cleared
+  // first, reserve it once and it doesn't allocate.
+  void drain(std::vector<command_t>& batch, size_t max_n, std::chrono::milliseconds wait_for)
+  {
+    batch.clear();
+    batch.push_back(pop(wait_for));
 
-    if ( q.empty() )
+    command_t command;
+    while ( batch.size() < max_n )
     {
-      return timeout_cb;
+      if ( !m_timers.empty() ) {
+        push_due_timers(clock::now());
+      }
+      // Don't wait for a push half way through, it makes the next batch.
+      if ( try_pop(command) != pop_result_t::popped ) {
+        break;
+      }
+      batch.push_back(std::move(command));
     }
-    else
+  }
+private:
+  void push_due_timers(clock::time_point now)
+  {
+    while ( !m_timers.empty() && m_timers.front().when <= now )
     {
-      std::function<void()> command = std::move(q.front());
-      q.pop();
-      return std::move(command);
+      std::pop_heap(m_timers.begin(), m_timers.end());
+      timer_entry_t& t = m_timers.back();
+      m_lanes[static_cast<size_t>(t.lane)].enqueue(t.node);
+      m_timers.pop_back();
     }
   }
 private:
-  std::mutex lock;
-  std::condition_variable rdy;
-  std::queue<std::function<void()>> q;
+  pop_result_t try_pop(command_t& command)
+  {
+    // A starved lane first, the lowest one if there are more.
+    for ( size_t i = lanes; i-- > 1; )
+    {
+      if ( m_passed[i] >= starvation_limit && take(i, command) == pop_result_t::popped ) {
+        return pop_result_t::popped;
+      }
+    }
+
+    bool busy = false;
+    for ( size_t i = 0; i < lanes; i++ )
+    {
+      switch ( take(i, command) )
+      {
+        case pop_result_t::popped:
+          return pop_result_t::popped;
+        case pop_result_t::busy:
+          busy = true;
+          break;
+        case pop_result_t::empty:
+          break;
+      }
+    }
+    return busy ? pop_result_t::busy : pop_result_t::empty;
+  }
+private:
+  pop_result_t take(size_t lane, command_t& command)
+  {
+    pop_result_t result = m_lanes[lane].try_pop(command);
+
+    if ( result == pop_result_t::empty ) {
+      m_passed[lane] = 0;
+    }
+    else if ( result == pop_result_t::popped )
+    {
+      m_passed[lane] = 0;
+      for ( size_t i = lane+1; i < lanes; i++ )
+      {
+        if ( m_lanes[i].ready() ) {
+          m_passed[i]++;
+        }
+      }
+    }
+    return result;
+  }
+private:
+  static void futex_wait(std::atomic<int>* word, int expected, std::chrono::nanoseconds timeout)
+  {
+    auto s = std::chrono::duration_cast<std::chrono::seconds>(timeout);
+
+    timespec ts;
+    ts.tv_sec = s.count();
+    ts.tv_nsec = (timeout-s).count();
+
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAIT_PRIVATE, expected, &ts, nullptr, 0);
+  }
+  static void futex_wake(std::atomic<int>* word)
+  {
+    syscall(SYS_futex, reinterpret_cast<int*>(word), FUTEX_WAKE_PRIVATE, 1, nullptr, nullptr, 0);
+  }
+private:
+  static_assert(sizeof(std::atomic<int>) == sizeof(int), "futex word must be a plain int");
+private:
+  lane_queue_t m_lanes[lanes];
+  unsigned m_passed[lanes];
+  std::vector<timer_entry_t> m_timers;
+  timer_id_t m_next_timer_id;
+  std::atomic<int> m_sleeping;
 };
 
 // ----------------------------------------------------------------------------
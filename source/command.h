@@ -0,0 +1,165 @@
+// ----------------------------------------------------------------------------
+//
+//        Filename:  command.h
+//
+//          Author:  Benny Bach
+//
+// --- Description: -----------------------------------------------------------
+//
+// A move only void() callable for the command queues. Captures up to
+// capacity bytes are stored in the command itself, larger ones up to
+// overflow_capacity in a block from a slab pool. Anything bigger doesn't
+// compile, capture a pointer or a shared_ptr instead.
+//
+// ----------------------------------------------------------------------------
+#ifndef __command_h__
+#define __command_h__
+
+// ----------------------------------------------------------------------------
+#include <slab_pool.h>
+
+// ----------------------------------------------------------------------------
+#include <cstddef>
+#include <new>
+#include <type_traits>
+#include <utility>
+
+// ----------------------------------------------------------------------------
+class command_t
+{
+public:
+  static const size_t capacity = 48;
+  static const size_t overflow_capacity = 256;
+private:
+  using overflow_pool = slab_pool_t<overflow_capacity>;
+private:
+  struct ops_t
+  {
+    void (*invoke)(void* storage);
+    void (*move)(void* to, void* from);
+    void (*destroy)(void* storage);
+  };
+  template <typename F> struct inline_ops
+  {
+    static F* get(void* storage)            { return static_cast<F*>(storage); }
+    static void invoke(void* storage)       { (*get(storage))(); }
+    static void move(void* to, void* from)  { new (to) F(std::move(*get(from))); get(from)->~F(); }
+    static void destroy(void* storage)      { get(storage)->~F(); }
+    static const ops_t table;
+  };
+  template <typename F> struct overflow_ops
+  {
+    static F* get(void* storage)            { return *static_cast<F**>(storage); }
+    static void invoke(void* storage)       { (*get(storage))(); }
+    static void move(void* to, void* from)  { *static_cast<F**>(to) = get(from); }
+    static void destroy(void* storage)      { F* f = get(storage); f->~F(); overflow_pool::deallocate(f); }
+    static const ops_t table;
+  };
+  template <typename F> struct fits_inline : std::integral_constant<bool,
+    sizeof(F) <= capacity &&
+    alignof(F) <= alignof(std::max_align_t) &&
+    std::is_nothrow_move_constructible<F>::value>
+  {
+  };
+public:
+  command_t() noexcept : m_ops(nullptr)
+  {
+  }
+public:
+  template <typename F, typename = typename std::enable_if<!std::is_same<typename std::decay<F>::type, command_t>::value>::type>
+  command_t(F&& f) : m_ops(nullptr)
+  {
+    using fn_t = typename std::decay<F>::type;
+
+    static_assert(sizeof(fn_t) <= overflow_capacity, "command captures too much, capture a pointer or a shared_ptr instead");
+    static_assert(alignof(fn_t) <= alignof(std::max_align_t), "command capture is over aligned");
+
+    construct<fn_t>(std::forward<F>(f), fits_inline<fn_t>());
+  }
+public:
+  command_t(command_t&& other) noexcept : m_ops(other.m_ops)
+  {
+    if ( m_ops )
+    {
+      m_ops->move(m_storage, other.m_storage);
+      other.m_ops = nullptr;
+    }
+  }
+public:
+  command_t& operator=(command_t&& rhs) noexcept
+  {
+    if ( this != &rhs )
+    {
+      reset();
+      if ( rhs.m_ops )
+      {
+        rhs.m_ops->move(m_storage, rhs.m_storage);
+        m_ops = rhs.m_ops;
+        rhs.m_ops = nullptr;
+      }
+    }
+    return *this;
+  }
+public:
+  command_t(const command_t&) = delete;
+  command_t& operator=(const command_t&) = delete;
+public:
+  ~command_t()
+  {
+    reset();
+  }
+public:
+  explicit operator bool() const noexcept
+  {
+    return m_ops != nullptr;
+  }
+public:
+  // An empty command does nothing.
+  void operator()()
+  {
+    if ( m_ops ) {
+      m_ops->invoke(m_storage);
+    }
+  }
+private:
+  template <typename F, typename A> void construct(A&& f, std::true_type)
+  {
+    new (m_storage) F(std::forward<A>(f));
+    m_ops = &inline_ops<F>::table;
+  }
+  template <typename F, typename A> void construct(A&& f, std::false_type)
+  {
+    void* block = overflow_pool::allocate();
+    try {
+      *reinterpret_cast<F**>(m_storage) = new (block) F(std::forward<A>(f));
+    }
+    catch ( ... )
+    {
+      overflow_pool::deallocate(block);
+      throw;
+    }
+    m_ops = &overflow_ops<F>::table;
+  }
+private:
+  void reset() noexcept
+  {
+    if ( m_ops )
+    {
+      m_ops->destroy(m_storage);
+      m_ops = nullptr;
+    }
+  }
+private:
+  alignas(std::max_align_t) unsigned char m_storage[capacity];
+  const ops_t* m_ops;
+};
+
+// ----------------------------------------------------------------------------
+template <typename F>
+const command_t::ops_t command_t::inline_ops<F>::table = { &invoke, &move, &destroy };
+
+template <typename F>
+const command_t::ops_t command_t::overflow_ops<F>::table = { &invoke, &move, &destroy };
+
+// ----------------------------------------------------------------------------
+#endif // __command_h__
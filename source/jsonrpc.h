@@ -39,13 +39,13 @@ public:
     return std::move(json::object{ { "code", m_error_code }, { "messge", "Invalid Request" } });
   }
 public:
-  static jsonrpc_request from_json(json::value& v)
+  static jsonrpc_request from_json(const json::value& v)
   {
     jsonrpc_request self;
 
     if ( v.is_object() )
     {
-      auto& o = v.as_object();
+      const json::object& o = v.as_object();
 
       if ( !o["jsonrpc"].is_string() ) {
         self.m_error_code = -32600;
@@ -73,6 +73,150 @@ public:
     }
     return std::move(self);
   }
+public:
+  // Read a request straight from a received frame. Only params and id are
+  // built as values, the rest of the envelope is picked out of the parse
+  // events.
+  static jsonrpc_request from_buffer(const char* data, size_t len)
+  {
+    jsonrpc_request self;
+    reader          reader(self);
+    json::sax_parser parser(reader);
+
+    parser.parse(data, len);
+
+    if ( !parser.complete() || !reader.valid() ) {
+      self.m_error_code = -32600;
+    }
+    return std::move(self);
+  }
+private:
+  class reader : public json::sax_handler
+  {
+    enum class member { other, jsonrpc, method, params, id };
+  public:
+    reader(jsonrpc_request& request)
+      :
+      m_request(request),
+      m_params(request.m_params),
+      m_id(request.m_id),
+      m_depth(0),
+      m_member(member::other),
+      m_has_version(false),
+      m_has_method(false),
+      m_is_object(false)
+    {
+    }
+  public:
+    bool valid() const
+    {
+      return m_is_object && m_has_version && m_has_method && !m_request.m_params.is_null();
+    }
+  public:
+    void null()            { if ( target() ) target()->null(); }
+    void boolean(bool v)   { if ( target() ) target()->boolean(v); }
+    void number(double v)  { if ( target() ) target()->number(v); }
+    void integer(long long v) { if ( target() ) target()->integer(v); }
+  public:
+    void string(const char* s, size_t len)
+    {
+      if ( m_depth == 1 && m_member == member::jsonrpc )
+      {
+        m_request.m_version.assign(s, len);
+        m_has_version = true;
+      }
+      else if ( m_depth == 1 && m_member == member::method )
+      {
+        m_request.m_method.assign(s, len);
+        m_has_method = true;
+      }
+      else if ( target() )
+      {
+        target()->string(s, len);
+      }
+    }
+  public:
+    void start_object()
+    {
+      if ( m_depth == 0 ) {
+        m_is_object = true;
+      }
+      else if ( target() ) {
+        target()->start_object();
+      }
+      m_depth++;
+    }
+  public:
+    void key(const char* s, size_t len)
+    {
+      if ( m_depth == 1 ) {
+        m_member = member_from_key(s, len);
+      }
+      else if ( target() ) {
+        target()->key(s, len);
+      }
+    }
+  public:
+    void end_object()
+    {
+      m_depth--;
+      if ( target() ) {
+        target()->end_object();
+      }
+    }
+  public:
+    void start_array()
+    {
+      if ( target() ) {
+        target()->start_array();
+      }
+      m_depth++;
+    }
+  public:
+    void end_array()
+    {
+      m_depth--;
+      if ( target() ) {
+        target()->end_array();
+      }
+    }
+  private:
+    // Handler that should see events for the current member value.
+    json::sax_handler* target()
+    {
+      if ( m_depth == 0 ) {
+        return 0;
+      }
+
+      switch ( m_member )
+      {
+        case member::params: return &m_params;
+        case member::id:     return &m_id;
+        default:             return 0;
+      }
+    }
+  private:
+    static member member_from_key(const char* s, size_t len)
+    {
+      std::string k(s, len);
+
+      if ( k == "jsonrpc" ) return member::jsonrpc;
+      if ( k == "method" )  return member::method;
+      if ( k == "params" )  return member::params;
+      if ( k == "id" )      return member::id;
+
+      return member::other;
+    }
+  private:
+    jsonrpc_request&    m_request;
+    json::value_builder m_params;
+    json::value_builder m_id;
+    int                 m_depth;
+    member              m_member;
+    bool                m_has_version;
+    bool                m_has_method;
+    bool                m_is_object;
+  };
 private:
   std::string m_version;
   std::string m_method;
@@ -86,7 +230,9 @@ private:
 class jsonrpc_handler
 {
 public:
-  virtual void call_method(const std::string& method, json::value params, json::object& response) = 0;
+  // Result values may be allocated in arena, it lives until the response
+  // has been sent.
+  virtual void call_method(const std::string& method, const json::value& params, json::object& response, json::arena& arena) = 0;
 };
 
 // ----------------------------------------------------------------------------
@@ -58,14 +58,14 @@ public:
     spotify.observer_detach(observer);
   }
 public:
-  virtual void call_method(const std::string& method, json::value params, json::object& response)
+  virtual void call_method(const std::string& method, const json::value& params, json::object& response, json::arena& arena)
   {
     _log_(info) << "method: '" << method << "', params:" << params;
 
     if ( method == "sync" )
     {
       // TODO: Error handling.
-      json::object o = params.as_object();
+      const json::object& o = params.as_object();
 
       long long incarnation = -1;
       long long transaction = -1;
@@ -78,20 +78,20 @@ public:
         transaction = std::stol(o["transaction"].as_string());
       }
 
-      auto v = spotify.get_tracks(incarnation, transaction).get();
+      auto v = spotify.get_tracks(arena, incarnation, transaction).get();
 
       _log_(info)
         << "sync result"
         << " incarnation=" << v["incarnation"].as_string()
         << ", transaction=" << v["transaction"].as_string();
 
-      response["result"] = v;
+      response["result"] = std::move(v);
     }
     else if ( method == "play" )
     {
       if ( params.is_object() )
       {
-        json::object o = params.as_object();
+        const json::object& o = params.as_object();
 
         if ( o["playlist"].is_string() )
         {
@@ -107,7 +107,7 @@ public:
             spotify.build_track_set_from_playlist(pl);
           }
         }
-        else if ( o["rating"].is_string() && o["rating"].as_string() == "unrated" )
+        else if ( o["rating"].equals("unrated") )
         {
           spotify.player_stop();
           spotify.build_track_set_unrated();
@@ -141,7 +141,7 @@ public:
     }
     else if ( method == "queue" )
     {
-      json::array p = params.as_array();
+      const json::array& p = params.as_array();
       auto v = p[0].as_string();
 
       spotify.player_play(v);
@@ -152,13 +152,14 @@ public:
     {
       if ( params.is_object() )
       {
-        json::object o = params.as_object();
+        const json::object& o = params.as_object();
 
         if ( o["track_id"].is_string() && o["cover_id"].is_string() )
         {
           auto v = spotify.get_cover(o["track_id"].as_string(), o["cover_id"].as_string()).get();
-          if ( !v["error"].is_null() ) {
-            response["error"] = std::move(v["error"]);
+          json::value* error = v.find(json::keys::error);
+          if ( error && !error->is_null() ) {
+            response["error"] = std::move(*error);
           }
           else {
             response["result"] = std::move(v);
@@ -203,6 +204,22 @@ public:
       notify_sender->send_notify(std::move(notify));
     }
   }
+
+  void track_patch_event(json::object event)
+  {
+    // An import patches a lot of tracks, don't log them all.
+    _log_(info) << __FUNCTION__ << " transaction=" << event["transaction"] << ", tracks=" << event["tracks"].as_array().size();
+    if ( notify_sender )
+    {
+      json::object notify{
+        { "jsonrpc", "2.0" },
+        { "method", "track-patch" },
+        { "params", std::move(event) }
+      };
+
+      notify_sender->send_notify(std::move(notify));
+    }
+  }
 private:
   spotify_t& spotify;
   notify_sender_t* notify_sender;
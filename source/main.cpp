@@ -25,6 +25,7 @@
 #include <chrono>
 #include <vector>
 #include <regex>
+#include <atomic>
 
 // ----------------------------------------------------------------------------
 #include <signal.h>
@@ -93,7 +94,7 @@ void parse_conf_file(const std::string& filename, options& options)
       throw std::runtime_error("configuration file must be a json object!");
     }
 
-    json::object conf = doc.as_object();
+    const json::object& conf = doc.as_object();
 
     if ( options.username.length() == 0 && conf["spotify_username"].is_string() ) {
       options.username = conf["spotify_username"].as_string();
@@ -143,6 +144,13 @@ void parse_conf_file(const std::string& filename, options& options)
   }
 }
 
+// ----------------------------------------------------------------------------
+enum class encoding
+{
+  json,
+  msgpack
+};
+
 // ----------------------------------------------------------------------------
 class client_connection : public notify_sender_t
 {
@@ -152,7 +160,9 @@ public:
     m_socket(std::move(socket)),
     m_handler(handler),
     m_cmdq(),
-    m_running(false)
+    m_running(false),
+    m_encoding(encoding::json),
+    m_response_encoding(encoding::json)
   {
     m_handler->player_observer_attach(m_handler);
   }
@@ -163,7 +173,9 @@ public:
     m_handler(std::move(other.m_handler)),
     //m_cmdq(std::move(other.m_cmdq)),
     m_cmdq(),
-    m_running(false)
+    m_running(false),
+    m_encoding(encoding::json),
+    m_response_encoding(encoding::json)
   {
   }
 public:
@@ -176,37 +188,53 @@ public:
 private:
   client_connection(const client_connection&) = delete;
   client_connection& operator=(const client_connection&) = delete;
-public:
-  void send(json::value message)
+private:
+  // Length prefixed frame of message in encoding e.
+  static std::shared_ptr<std::string> frame(const json::value& message, encoding e)
   {
-    m_cmdq.push([=]()
-    {
-      std::stringstream os;
-
-      os << message;
-
-      std::string body = os.str();
-
-      std::vector<unsigned char> buf(4);
+    // The length is filled in when the body is written.
+    auto buf = std::make_shared<std::string>(4, '\0');
 
-      size_t len = body.length();
-      buf[0] = len>>24;
-      buf[1] = len>>16;
-      buf[2] = len>>8;
-      buf[3] = len;
+    if ( e == encoding::msgpack ) {
+      json::msgpack_writer(*buf).write(message);
+    }
+    else {
+      json::writer(*buf).write(message);
+    }
 
-      buf.insert(begin(buf)+4, begin(body), end(body));
+    size_t len = buf->size()-4;
+    (*buf)[0] = len>>24;
+    (*buf)[1] = len>>16;
+    (*buf)[2] = len>>8;
+    (*buf)[3] = len;
 
-      size_t sent = 0;
-      do {
-        sent += m_socket.send(buf.data(), buf.size(), 0);
-      } while ( sent < buf.size() );
-    });
+    return buf;
+  }
+private:
+  // Only from the connection thread.
+  void write(const std::string& buf)
+  {
+    size_t sent = 0;
+    do {
+      sent += m_socket.send(buf.data()+sent, buf.size()-sent, 0);
+    } while ( sent < buf.size() );
+  }
+private:
+  // Only from the receive thread. Responses are serialized right away so
+  // the message, which may live in a request arena, is not needed once
+  // send returns.
+  void send(json::value message)
+  {
+    auto buf = frame(message, m_response_encoding);
+    m_cmdq.push([=]() { write(*buf); });
   }
 public:
+  // From any thread. The notification is serialized on the connection
+  // thread, in the encoding in effect where it goes out.
   void send_notify(json::value message)
   {
-    send(message);
+    auto msg = std::make_shared<json::value>(std::move(message));
+    m_cmdq.push([=]() { write(*frame(*msg, m_encoding)); });
   }
 private:
   void disconnect()
@@ -233,7 +261,7 @@ public:
       {
         auto cmd = m_cmdq.pop(std::chrono::seconds(60), [this]{
           _log_(debug) << "client connection idle";
-          send(json::object());
+          write(*frame(json::object(), m_encoding));
         });
         cmd();
       }
@@ -296,23 +324,22 @@ private:
 
     receive(bbuf.data(), hlen);
 
-    json::value  doc;
-    json::parser parser(doc);
+    auto request = decode_request(reinterpret_cast<char*>(bbuf.data()), hlen);
 
-    size_t consumed = parser.parse(reinterpret_cast<char*>(bbuf.data()), hlen);
-
-    _log_(debug) << "parser consumed=" << consumed << ", complete=" << parser.complete();
-    //std::cout << "body: '" << doc << "'" << std::endl;
-
-    auto request = jsonrpc_request::from_json(doc);
-
-    if ( request.is_valid() )
+    if ( request.is_valid() && request.method() == "set-encoding" )
     {
+      set_encoding(request);
+    }
+    else if ( request.is_valid() )
+    {
+      // Arena for the result, must outlive the response.
+      json::arena arena;
+
       json::object response{ { "jsonrpc", "2.0" }, { "id", request.id() } };
 
-      _log_(debug) << "received request " << doc;
+      _log_(debug) << "received request " << request.method() << " " << request.params();
 
-      m_handler->call_method(request.method(), request.params(), response);
+      m_handler->call_method(request.method(), request.params(), response, arena);
 
       send(std::move(response));
     }
@@ -330,6 +357,67 @@ private:
     }
   }
 private:
+  // Requests are taken in either encoding. Json text starts with '{' or
+  // white space, a msgpack request with a map.
+  static jsonrpc_request decode_request(const char* data, size_t len)
+  {
+    unsigned char c = len > 0 ? data[0] : 0;
+
+    if ( (c & 0xf0) == 0x80 || c == 0xde || c == 0xdf )
+    {
+      json::value v;
+
+      try
+      {
+        json::msgpack_parser parser(v);
+        parser.parse(data, len);
+      }
+      catch (const json::error& e)
+      {
+        _log_(info) << "invalid msgpack request: " << e.what();
+        v = json::value();
+      }
+      return jsonrpc_request::from_json(v);
+    }
+    return jsonrpc_request::from_buffer(data, len);
+  }
+private:
+  // Responses and notifications are sent in the encoding the client asked
+  // for, json text until it asks. The response to the request itself is
+  // still in the old encoding. It is written and the connection thread
+  // switches in one command, so every notification queued before goes out
+  // ahead of it in the old encoding and every one after in the new.
+  void set_encoding(jsonrpc_request& request)
+  {
+    json::object response{ { "jsonrpc", "2.0" }, { "id", request.id() } };
+    const json::value& params = request.params();
+    std::string name;
+
+    if ( params.is_object() && params.as_object()["encoding"].is_string() ) {
+      name = params.as_object()["encoding"].as_string();
+    }
+
+    if ( name == "json" || name == "msgpack" )
+    {
+      response["result"] = "ok";
+
+      encoding e = name == "json" ? encoding::json : encoding::msgpack;
+      auto buf = frame(response, m_response_encoding);
+      m_response_encoding = e;
+
+      m_cmdq.push([=]()
+      {
+        write(*buf);
+        m_encoding = e;
+      });
+    }
+    else
+    {
+      response["error"] = json::object{ { "code", -32602 }, { "message", "Invalid parameters" } };
+      send(std::move(response));
+    }
+  }
+private:
   void receive(unsigned char* buf, size_t len)
   {
     size_t i = 0;
@@ -347,6 +435,10 @@ private:
   std::shared_ptr<jsonrpc_spotify_handler> m_handler;
   cmdque_t m_cmdq;
   bool m_running;
+  // Encoding on the wire, only used on the connection thread, and the
+  // encoding of responses, only used on the receive thread.
+  encoding m_encoding;
+  encoding m_response_encoding;
 };
 
 // ----------------------------------------------------------------------------
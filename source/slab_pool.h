@@ -0,0 +1,114 @@
+// ----------------------------------------------------------------------------
+//
+//        Filename:  slab_pool.h
+//
+//          Author:  Benny Bach
+//
+// --- Description: -----------------------------------------------------------
+//
+// Fixed size blocks carved out of slabs that are never returned to the heap.
+// Freed blocks go on a shared list, each thread takes the whole list at once
+// into a cache of its own and allocates from that. Taking everything with a
+// single exchange, and only ever pushing single blocks, keeps the shared list
+// free of the ABA problem without locks.
+//
+// ----------------------------------------------------------------------------
+#ifndef __slab_pool_h__
+#define __slab_pool_h__
+
+// ----------------------------------------------------------------------------
+#include <atomic>
+#include <cstddef>
+#include <new>
+
+// ----------------------------------------------------------------------------
+template <size_t Size>
+class slab_pool_t
+{
+private:
+  union block_t
+  {
+    block_t* next;
+    alignas(std::max_align_t) unsigned char data[Size];
+  };
+  struct cache_t
+  {
+    cache_t() : head(nullptr)
+    {
+    }
+    ~cache_t()
+    {
+      // Hand what is left to the threads still running.
+      while ( head )
+      {
+        block_t* b = head;
+        head = b->next;
+        release(b);
+      }
+    }
+    block_t* head;
+  };
+public:
+  static const size_t block_size = Size;
+  static const size_t blocks_per_slab = 64;
+public:
+  static void* allocate()
+  {
+    cache_t& c = cache;
+
+    if ( !c.head )
+    {
+      c.head = free_list.exchange(nullptr, std::memory_order_acquire);
+      if ( !c.head ) {
+        c.head = new_slab();
+      }
+    }
+
+    block_t* b = c.head;
+    c.head = b->next;
+    return b->data;
+  }
+public:
+  static void deallocate(void* p)
+  {
+    release(reinterpret_cast<block_t*>(p));
+  }
+private:
+  static void release(block_t* b)
+  {
+    b->next = free_list.load(std::memory_order_relaxed);
+    while ( !free_list.compare_exchange_weak(b->next, b, std::memory_order_release, std::memory_order_relaxed) ) {
+    }
+  }
+private:
+  static block_t* new_slab()
+  {
+    block_t* slab = new block_t[blocks_per_slab];
+
+    for ( size_t i = 0; i+1 < blocks_per_slab; i++ ) {
+      slab[i].next = &slab[i+1];
+    }
+    slab[blocks_per_slab-1].next = nullptr;
+
+    return slab;
+  }
+private:
+  static std::atomic<block_t*> free_list;
+  static thread_local cache_t cache;
+};
+
+// ----------------------------------------------------------------------------
+template <size_t Size>
+const size_t slab_pool_t<Size>::block_size;
+
+template <size_t Size>
+const size_t slab_pool_t<Size>::blocks_per_slab;
+
+template <size_t Size>
+std::atomic<typename slab_pool_t<Size>::block_t*> slab_pool_t<Size>::free_list(nullptr);
+
+template <size_t Size>
+thread_local typename slab_pool_t<Size>::cache_t slab_pool_t<Size>::cache;
+
+// ----------------------------------------------------------------------------
+#endif // __slab_pool_h__
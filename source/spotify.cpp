@@ -15,7 +15,6 @@
 #include <random>
 #include <algorithm>
 
-#include <b64/encode.h>
 
 // ----------------------------------------------------------------------------
 static std::string sp_track_id(sp_track* track);
@@ -33,6 +32,7 @@ spotify_t::spotify_t(const std::string& audio_device_name,
   m_session_logged_in(false),
   m_running(true),
   m_session_next_timeout(0),
+  m_process_events_timer(0),
   m_track(0),
   m_playlistcontainer(0),
   m_track_playing(false),
@@ -46,12 +46,13 @@ spotify_t::spotify_t(const std::string& audio_device_name,
   m_tracks(),
   m_tracks_initialized(false), // Not used yet.
   m_tracks_incarnation(reinterpret_cast<long long>(this)),
-  m_tracks_transaction(0), // Always zero for now.
+  m_tracks_transaction(0), // Counts track patches sent to observers.
   m_track_stat_filename(track_stat_filename),
   /////
   m_volume_normalization(false),
   m_continued_playback(true),
   m_continued_unrated(false),
+  m_writer_pool(),
   m_thr{&spotify_t::main, this}
 {
   _log_(debug) << "constructed spotify instance " << this;
@@ -71,7 +72,7 @@ spotify_t::~spotify_t()
 // ----------------------------------------------------------------------------
 void spotify_t::stop()
 {
-  m_command_queue.push([this]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [this]()
   {
     if ( m_track_playing )
     {
@@ -92,7 +93,7 @@ void spotify_t::stop()
 // ----------------------------------------------------------------------------
 void spotify_t::login(const std::string& username, const std::string& password)
 {
-  m_command_queue.push([=]() {
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]() {
     sp_session_login(m_session, username.c_str(), password.c_str(), 0, 0);
   });
 }
@@ -100,7 +101,7 @@ void spotify_t::login(const std::string& username, const std::string& password)
 // ----------------------------------------------------------------------------
 void spotify_t::player_play()
 {
-  m_command_queue.push([=]() {
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]() {
     if ( m_session_logged_in && m_track )
     {
       // TODO: Include track.
@@ -116,7 +117,7 @@ void spotify_t::player_play()
 // ----------------------------------------------------------------------------
 void spotify_t::player_play(const std::string& uri)
 {
-  m_command_queue.push([=]() {
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]() {
     m_play_queue.push_back(uri);
     if ( m_session_logged_in && !m_track ) {
       play_next_from_queue();
@@ -127,7 +128,7 @@ void spotify_t::player_play(const std::string& uri)
 // ----------------------------------------------------------------------------
 void spotify_t::player_pause()
 {
-  m_command_queue.push([=]() {
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]() {
     if ( m_session_logged_in && m_track )
     {
       player_state_notify("paused");
@@ -139,7 +140,7 @@ void spotify_t::player_pause()
 // ----------------------------------------------------------------------------
 void spotify_t::player_skip()
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     if ( m_track_playing )
     {
@@ -172,7 +173,7 @@ void spotify_t::player_skip()
 // ----------------------------------------------------------------------------
 void spotify_t::player_stop()
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     if ( m_track_playing )
     {
@@ -192,7 +193,7 @@ void spotify_t::player_stop()
 // ----------------------------------------------------------------------------
 void spotify_t::build_track_set_all()
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     m_continued_unrated = false;
     m_continued_playlist.clear();
@@ -203,7 +204,7 @@ void spotify_t::build_track_set_all()
 // ----------------------------------------------------------------------------
 void spotify_t::build_track_set_from_playlist(std::string playlist)
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     m_continued_unrated = false;
     m_continued_playlist = playlist;
@@ -214,7 +215,7 @@ void spotify_t::build_track_set_from_playlist(std::string playlist)
 // ----------------------------------------------------------------------------
 void spotify_t::build_track_set_unrated()
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     m_continued_unrated = true;
     m_continued_playlist.clear();
@@ -223,11 +224,13 @@ void spotify_t::build_track_set_unrated()
 }
 
 // ----------------------------------------------------------------------------
-std::future<json::object> spotify_t::get_tracks(long long incarnation, long long transaction)
+std::future<json::object> spotify_t::get_tracks(json::arena& arena, long long incarnation, long long transaction)
 {
   auto promise = std::make_shared<std::promise<json::object>>();
 
-  m_command_queue.push([=]()
+  // The result is built in the callers arena, which stays alive while the
+  // caller waits for the future.
+  m_command_queue.push(cmdque_t::lane_t::bulk, [=, &arena]()
   {
     _log_(info)
       << "get_tracks"
@@ -236,25 +239,39 @@ std::future<json::object> spotify_t::get_tracks(long long incarnation, long long
       << ", m_tracks_transaction=" << m_tracks_transaction
       << ", transaction=" << transaction;
 
-    json::object result{
-      { "incarnation", std::to_string(m_tracks_incarnation) },
-      { "transaction", std::to_string(m_tracks_transaction) }
-    };
+    json::object result(arena);
+
+    result.member("incarnation", json::value(std::to_string(m_tracks_incarnation), arena));
+    result.member("transaction", json::value(std::to_string(m_tracks_transaction), arena));
 
     if ( incarnation != m_tracks_incarnation )
     {
-      // If incarnation has changed send back the complete track list.
-      json::array tracks;
+      // If incarnation has changed send back the complete track list,
+      // written straight out and passed on as is.
+      std::vector<const track_t*> all;
+      all.reserve(m_tracks.size());
       for ( auto& t : m_tracks ) {
-        tracks.push_back(to_json(*t.second));
+        all.push_back(t.second.get());
       }
-      result["tracks"] = tracks;
+
+      // Tracks keep their json until they change, so this is mostly
+      // copying. Large libraries are put together in chunks on the writer
+      // pool, this thread waits and the tracks don't change meanwhile.
+      std::string tracks;
+      json::writer writer(tracks);
+
+      json::write_array(writer, m_writer_pool, all.size(), [&](json::writer& w, size_t i)
+      {
+        w.buffer().append(all[i]->serialized());
+      });
+
+      result.member("tracks", json::value::raw(tracks, arena));
     }
     else
     {
       // TODO: Handle transaction count to only send back what has been updated.
     }
-    promise->set_value(result);
+    promise->set_value(std::move(result));
   });
 
   return promise->get_future();
@@ -265,7 +282,7 @@ std::future<json::object> spotify_t::get_cover(const std::string& track_id, cons
 {
   auto promise = std::make_shared<std::promise<json::object>>();
 
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     sp_link* link = sp_link_create_from_string(cover_id.c_str());
 
@@ -320,7 +337,7 @@ std::future<json::object> spotify_t::get_cover(const std::string& track_id, cons
         sp_error res = sp_image_add_load_callback(image, [](sp_image *image, void *userdata)
           {
             spotify_t* self = reinterpret_cast<spotify_t*>(userdata);
-            self->m_command_queue.push(std::bind(&spotify_t::image_loaded_handler, self, image));
+            self->m_command_queue.push(cmdque_t::lane_t::interactive, std::bind(&spotify_t::image_loaded_handler, self, image));
           },
           this
         );
@@ -340,7 +357,7 @@ std::future<json::object> spotify_t::get_cover(const std::string& track_id, cons
 // ----------------------------------------------------------------------------
 void spotify_t::observer_attach(std::shared_ptr<player_observer_t> observer)
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     observers.push_back(observer);
 
@@ -365,7 +382,7 @@ void spotify_t::observer_attach(std::shared_ptr<player_observer_t> observer)
 // ----------------------------------------------------------------------------
 void spotify_t::observer_detach(std::shared_ptr<player_observer_t> observer)
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
   {
     auto it = std::find(observers.begin(), observers.end(), observer);
     observers.erase(it);
@@ -444,18 +461,28 @@ void spotify_t::main()
   try
   {
     init();
+
+    // Everything periodic runs from timers, libspotify is called when it
+    // asks to be and the loop just waits for the next command.
+    process_events_handler();
+    process_tracks_timer();
+    continued_playback_timer();
+
+    // Take what is ready in small batches, a batch runs to the end before
+    // anything newer, whatever its lane.
+    std::vector<command_t> batch;
+    batch.reserve(command_batch_size);
+
     while ( m_running )
     {
-      auto cmd = m_command_queue.pop(std::chrono::milliseconds(2500), [this]
+      m_command_queue.drain(batch, command_batch_size, std::chrono::seconds(60));
+      for ( auto& cmd : batch )
       {
-        // Check if there are tracke to be added and/or removed in the
-        // tracks to add/remove queues.
-        process_tracks_to_add();
-        process_tracks_to_remove();
-
-        fill_continued_playback_queue();
-      });
-      cmd();
+        cmd();
+        if ( !m_running ) {
+          break;
+        }
+      }
     }
 
     _log_(info) << "spotify_t::" << __FUNCTION__ << " releasing session " << m_session;
@@ -596,10 +623,37 @@ void spotify_t::end_of_track_handler()
 // ----------------------------------------------------------------------------
 void spotify_t::process_events_handler()
 {
-  do
-  {
-    sp_session_process_events(m_session, &m_session_next_timeout);
-  } while (m_session_next_timeout == 0);
+  // Called from notify_main_thread_cb or when the last call said to, the
+  // earlier deadline is dropped either way.
+  m_command_queue.cancel(m_process_events_timer);
+
+  sp_session_process_events(m_session, &m_session_next_timeout);
+
+  // A timeout of 0 means call again at once, that goes through the queue
+  // as well so other realtime commands are not held up.
+  m_process_events_timer = m_command_queue.schedule(std::chrono::milliseconds(m_session_next_timeout),
+    cmdque_t::lane_t::realtime, std::bind(&spotify_t::process_events_handler, this));
+}
+
+// ----------------------------------------------------------------------------
+void spotify_t::process_tracks_timer()
+{
+  // Check if there are tracks to be added and/or removed in the tracks to
+  // add/remove queues.
+  process_tracks_to_add();
+  process_tracks_to_remove();
+
+  m_command_queue.schedule(std::chrono::milliseconds(2500), cmdque_t::lane_t::bulk,
+    std::bind(&spotify_t::process_tracks_timer, this));
+}
+
+// ----------------------------------------------------------------------------
+void spotify_t::continued_playback_timer()
+{
+  fill_continued_playback_queue();
+
+  m_command_queue.schedule(std::chrono::milliseconds(2500), cmdque_t::lane_t::bulk,
+    std::bind(&spotify_t::continued_playback_timer, this));
 }
 
 // ----------------------------------------------------------------------------
@@ -614,24 +668,14 @@ void spotify_t::image_loaded_handler(sp_image* image)
 
   auto data = m_loading_images[image];
 
-  std::string image_data_s(reinterpret_cast<const char*>(image_data), size);
-
-  std::stringstream is;
-  std::stringstream os;
-
-  is.str(image_data_s);
-
-  base64::encoder b64;
-
-  b64.encode(is, os);
-
   json::object result{
     { "track_id", data.track_id },
     { "cover_id", data.cover_id }
   };
 
   result["image_format"] = "jpg";
-  result["image_data"] = os.str();
+  // Base64 in json text, bytes in msgpack.
+  result["image_data"] = json::value::binary(reinterpret_cast<const char*>(image_data), size);
 
   // Remove image pointer from loading images map.
   m_loading_images.erase(image);
@@ -702,7 +746,7 @@ void spotify_t::play_track(const std::string& uri)
 // ----------------------------------------------------------------------------
 void spotify_t::import_playlist(sp_playlist* sp_pl_ptr)
 {
-  m_command_queue.push([=]()
+  m_command_queue.push(cmdque_t::lane_t::bulk, [=]()
   {
     if ( ! sp_playlist_is_loaded(sp_pl_ptr) ) {
       //_log_(debug) << "playlist not loaded!";
@@ -790,14 +834,23 @@ void spotify_t::process_tracks_to_add()
     // Create a list of tracks to be inserted into playlist.
     std::vector<track_ptr> new_tracks;
 
+    // Changes are sent once for the whole import, and only worked out if
+    // someone is listening.
+    bool notify = !observers.empty();
+    json::array patches;
+
     for ( auto& sp_track_ptr : data.tracks )
     {
-      track_ptr track;
+      track_ptr   track;
+      std::string before;
 
       auto it = m_tracks.find(sp_track_id(sp_track_ptr));
       if ( it != end(m_tracks) )
       {
         track = (*it).second;
+        if ( notify ) {
+          before = track->serialized();
+        }
       }
       else
       {
@@ -805,6 +858,9 @@ void spotify_t::process_tracks_to_add()
       }
 
       track->playlists_add(data.playlist_name);
+      if ( notify ) {
+        track_patch_add(patches, *track, before);
+      }
 
       _log_(info) << "added track " << to_json(*track) << " to playlist '" << data.playlist_name << "'";
 
@@ -818,6 +874,8 @@ void spotify_t::process_tracks_to_add()
 
     pl.insert(pl.begin()+data.position, new_tracks.begin(), new_tracks.end());
 
+    track_patch_notify(std::move(patches));
+
     m_tracks_to_add.pop();
 
     //_log_(info) << "### AFTER ADD " << data.playlist_name;
@@ -835,6 +893,9 @@ void spotify_t::process_tracks_to_remove()
   {
     auto data = m_tracks_to_remove.front();
 
+    bool notify = !observers.empty();
+    json::array patches;
+
     try
     {
       auto& pl = m_playlists.at(data.playlist_name);
@@ -850,8 +911,16 @@ void spotify_t::process_tracks_to_remove()
         try
         {
           auto& track = pl.at(pos);
+          std::string before;
+
+          if ( notify ) {
+            before = track->serialized();
+          }
 
           track->playlists_remove(data.playlist_name);
+          if ( notify ) {
+            track_patch_add(patches, *track, before);
+          }
 
           _log_(info) << "removed track " << to_json(*track) << " from playlist '" << data.playlist_name << "'";
 
@@ -869,6 +938,8 @@ void spotify_t::process_tracks_to_remove()
       _log_(error) << "process_tracks_to_remove - playlist '" << data.playlist_name << "' not found";
     }
 
+    track_patch_notify(std::move(patches));
+
     m_tracks_to_remove.pop();
 
     //_log_(info) << "### AFTER REMOVE " << data.playlist_name;
@@ -971,6 +1042,62 @@ void spotify_t::player_state_notify(std::string state, std::shared_ptr<track_t>
   }
 }
 
+// ----------------------------------------------------------------------------
+static json::value parse_track_json(const std::string& text)
+{
+  json::value track;
+
+  if ( !text.empty() )
+  {
+    json::parser parser(track);
+    parser.parse(text.data(), text.size());
+  }
+  return track;
+}
+
+// ----------------------------------------------------------------------------
+void spotify_t::track_patch_add(json::array& patches, const track_t& track, const std::string& before)
+{
+  // before is the json of the track before it changed, empty for a new
+  // track. A new track is a patch replacing the whole document, its json is
+  // passed on as is. Observers get what changed rather than the whole track.
+  json::array patch = before.empty()
+    ? json::array{ json::object{ { "op", "replace" }, { "path", "" }, { "value", json::value::raw(track.serialized()) } } }
+    : json::diff(parse_track_json(before), parse_track_json(track.serialized()));
+
+  if ( patch.size() > 0 )
+  {
+    json::object changed;
+    changed["track_id"] = track.track_id();
+    changed["patch"] = std::move(patch);
+    patches.push_back(json::value(std::move(changed)));
+  }
+}
+
+// ----------------------------------------------------------------------------
+void spotify_t::track_patch_notify(json::array patches)
+{
+  if ( patches.size() == 0 || observers.empty() ) {
+    return;
+  }
+
+  m_tracks_transaction++;
+
+  json::object event;
+  event["transaction"] = std::to_string(m_tracks_transaction);
+  event["tracks"] = std::move(patches);
+
+  for ( auto& observer : observers )
+  {
+    if ( observer.get() ) {
+      observer->track_patch_event(event);
+    }
+    else {
+      _log_(error) << "observer is null";
+    }
+  }
+}
+
 // ----------------------------------------------------------------------------
 void spotify_t::set_playlist_callbacks(sp_playlist* pl)
 {
@@ -1001,7 +1128,21 @@ void spotify_t::track_stat_update(const std::string& track_id, const track_stat_
   auto it = m_tracks.find(track_id);
   if ( it != end(m_tracks) )
   {
+    bool notify = !observers.empty();
+    std::string before;
+
+    if ( notify ) {
+      before = (*it).second->serialized();
+    }
+
     (*it).second->rating(stat.rating());
+
+    if ( notify )
+    {
+      json::array patches;
+      track_patch_add(patches, *(*it).second, before);
+      track_patch_notify(std::move(patches));
+    }
   }
 }
 
@@ -1013,7 +1154,7 @@ void spotify_t::track_stat_update(const std::string& track_id, const track_stat_
 void spotify_t::logged_in_cb(sp_session *session, sp_error error)
 {
   spotify_t* self = reinterpret_cast<spotify_t*>(sp_session_userdata(session));
-  self->m_command_queue.push(std::bind(&spotify_t::logged_in_handler, self));
+  self->m_command_queue.push(cmdque_t::lane_t::interactive, std::bind(&spotify_t::logged_in_handler, self));
 }
 
 // ----------------------------------------------------------------------------
@@ -1032,7 +1173,7 @@ inline void spotify_t::metadata_updated_cb(sp_session *session)
   {
     sp_error err = sp_track_error(self->m_track);
     if (err == SP_ERROR_OK) {
-      self->m_command_queue.push(std::bind(&spotify_t::track_loaded_handler, self));
+      self->m_command_queue.push(cmdque_t::lane_t::realtime, std::bind(&spotify_t::track_loaded_handler, self));
     }
   }
 }
@@ -1053,7 +1194,7 @@ void spotify_t::message_to_user_cb(sp_session *session, const char* message)
 void spotify_t::notify_main_thread_cb(sp_session *session)
 {
   spotify_t* self = reinterpret_cast<spotify_t*>(sp_session_userdata(session));
-  self->m_command_queue.push(std::bind(&spotify_t::process_events_handler, self));
+  self->m_command_queue.push(cmdque_t::lane_t::realtime, std::bind(&spotify_t::process_events_handler, self));
 }
 
 // ----------------------------------------------------------------------------
@@ -1078,7 +1219,7 @@ int spotify_t::music_delivery(sp_session *session, const sp_audioformat *format,
   if ( self->m_track_playing )
   {
     auto audio_output = self->get_audio_output(44100, format->channels);
-    audio_output->write_s16_le_i(frames, num_frames);
+    return audio_output->write_s16_le_i(frames, num_frames);
   }
   else {
     _log_(warning) << "callback:  " << __FUNCTION__ << " while not playing";
@@ -1113,7 +1254,7 @@ void spotify_t::end_of_track_cb(sp_session *session)
 {
   //std::cout << "callback:  " << __FUNCTION__ << std::endl;
   spotify_t* self = reinterpret_cast<spotify_t*>(sp_session_userdata(session));
-  self->m_command_queue.push(std::bind(&spotify_t::end_of_track_handler, self));
+  self->m_command_queue.push(cmdque_t::lane_t::realtime, std::bind(&spotify_t::end_of_track_handler, self));
 }
 
 // ----------------------------------------------------------------------------
@@ -1135,7 +1276,7 @@ void spotify_t::start_playback_cb(sp_session *session)
 
   spotify_t* self = reinterpret_cast<spotify_t*>(sp_session_userdata(session));
 
-  self->m_command_queue.push(std::bind(&spotify_t::start_playback_handler, self));
+  self->m_command_queue.push(cmdque_t::lane_t::realtime, std::bind(&spotify_t::start_playback_handler, self));
 }
 
 // ----------------------------------------------------------------------------
@@ -1227,7 +1368,7 @@ void spotify_t::playlist_tracks_added_cb(sp_playlist *pl, sp_track *const *track
     data.tracks[i] = tracks[i];
   }
 
-  self->m_command_queue.push([=]()
+  self->m_command_queue.push(cmdque_t::lane_t::bulk, [=]()
     {
       _log_(info) << "queuing tracks to be added";
       self->m_tracks_to_add.push(data);
@@ -1263,7 +1404,7 @@ void spotify_t::playlist_tracks_removed_cb(sp_playlist *pl, const int *tracks, i
     data.positions[i] = tracks[i];
   }
 
-  self->m_command_queue.push([=]()
+  self->m_command_queue.push(cmdque_t::lane_t::bulk, [=]()
   {
     _log_(info) << "queuing tracks to be removed";
     self->m_tracks_to_remove.push(data);
@@ -1280,7 +1421,7 @@ void spotify_t::playlist_added_cb(sp_playlistcontainer *pc, sp_playlist *playlis
   self->import_playlist(playlist);
 
 #if 0
-  self->m_command_queue.push([=]()
+  self->m_command_queue.push(cmdque_t::lane_t::bulk, [=]()
     {
       _log_(info) << "queuing playlist to be imported";
       self->m_playlists_for_import.push(playlist);
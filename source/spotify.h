@@ -23,6 +23,7 @@
 #include <thread>
 #include <cassert>
 #include <deque>
+#include <queue>
 #include <unordered_map>
 #include <vector>
 #include <future>
@@ -52,6 +53,9 @@ class player_observer_t
 {
 public:
   virtual void player_state_event(json::object event) = 0;
+  // A track changed, event has the track_id, the new transaction and a json
+  // patch that turns the track as it was into the track as it is.
+  virtual void track_patch_event(json::object event) = 0;
 };
 
 // ----------------------------------------------------------------------------
@@ -109,7 +113,7 @@ public:
   void build_track_set_from_playlist(std::string playlist);
   void build_track_set_unrated();
 public:
-  std::future<json::object> get_tracks(long long incarnation = -1, long long transaction = -1);
+  std::future<json::object> get_tracks(json::arena& arena, long long incarnation = -1, long long transaction = -1);
 public:
   std::future<json::object> get_cover(const std::string& track_id, const std::string& cover_id);
 public:
@@ -119,12 +123,14 @@ public:
   void player_queue_clear()
   {
 #if 0
-    m_command_queue.push([=]()
+    m_command_queue.push(cmdque_t::lane_t::interactive, [=]()
     {
       m_play_queue.clear();
     });
 #endif
   }
+private:
+  static const size_t command_batch_size = 8;
 private:
   void init();
   void main();
@@ -134,6 +140,8 @@ private:
   void start_playback_handler();
   void end_of_track_handler();
   void process_events_handler();
+  void process_tracks_timer();
+  void continued_playback_timer();
   void image_loaded_handler(sp_image* image);
   void play_next_from_queue();
   void play_track(const std::string& uri);
@@ -146,6 +154,8 @@ private:
   std::shared_ptr<audio_output_t> get_audio_output();
 private:
   void player_state_notify(std::string state, std::shared_ptr<track_t> track = nullptr);
+  void track_patch_add(json::array& patches, const track_t& track, const std::string& before);
+  void track_patch_notify(json::array patches);
 private:
   void set_playlist_callbacks(sp_playlist* pl);
 private:
@@ -183,8 +193,11 @@ protected:
   sp_session* m_session;
   bool m_session_logged_in;
   bool m_running;
+  // Playback callbacks go in the realtime lane, client requests in the
+  // interactive lane, and playlist imports and full track lists in bulk.
   cmdque_t m_command_queue;
   int m_session_next_timeout;
+  cmdque_t::timer_id_t m_process_events_timer;
   std::deque<std::string> m_play_queue;
   sp_track* m_track;
   sp_playlistcontainer* m_playlistcontainer;
@@ -220,6 +233,9 @@ protected:
   /////
   // Loading images.
   std::map<sp_image*, loading_image_data> m_loading_images;
+  /////
+  // Serializes large track lists.
+  json::worker_pool m_writer_pool;
   std::thread m_thr;
 };
 
@@ -28,17 +28,17 @@ public:
   {
   }
 public:
-  void track_id(std::string track_id)         { m_track_id = std::move(track_id); }
-  void title(std::string title)               { m_title = std::move(title); }
-  void track_number(int track_number)         { m_track_number = track_number; }
-  void duration(int duration_in_msecs)        { m_duration = duration_in_msecs; }
-  void rating(double value)                   { m_rating = value; }
-  void artist(std::string artist)             { m_artist = std::move(artist); }
-  void album(std::string album)               { m_album = std::move(album); }
-  void album_id(std::string album_id)         { m_album_id = std::move(album_id); }
-  void playlists(pl_set_t playlists)          { m_playlists = std::move(playlists); }
-  void playlists_add(std::string playlist)    { m_playlists.insert(std::move(playlist)); }
-  void playlists_remove(const std::string& playlist) { m_playlists.erase(playlist); }
+  void track_id(std::string track_id)         { m_track_id = std::move(track_id); changed(); }
+  void title(std::string title)               { m_title = std::move(title); changed(); }
+  void track_number(int track_number)         { m_track_number = track_number; changed(); }
+  void duration(int duration_in_msecs)        { m_duration = duration_in_msecs; changed(); }
+  void rating(double value)                   { m_rating = value; changed(); }
+  void artist(std::string artist)             { m_artist = std::move(artist); changed(); }
+  void album(std::string album)               { m_album = std::move(album); changed(); }
+  void album_id(std::string album_id)         { m_album_id = std::move(album_id); changed(); }
+  void playlists(pl_set_t playlists)          { m_playlists = std::move(playlists); changed(); }
+  void playlists_add(std::string playlist)    { m_playlists.insert(std::move(playlist)); changed(); }
+  void playlists_remove(const std::string& playlist) { m_playlists.erase(playlist); changed(); }
   size_t playlists_size()                     { return m_playlists.size(); }
 public:
   const std::string& track_id() const         { return m_track_id; }
@@ -50,6 +50,12 @@ public:
   const std::string& album() const            { return m_album; }
   const std::string& album_id() const         { return m_album_id; }
   const pl_set_t&    playlists() const        { return m_playlists; }
+public:
+  // The track as json, kept until the track changes. A full sync is these
+  // put together.
+  const std::string& serialized() const;
+private:
+  void changed()                              { m_serialized.clear(); }
 private:
   std::string m_track_id;
   std::string m_title;
@@ -61,30 +67,42 @@ private:
   std::string m_album_id;
   std::string m_cover_id;
   pl_set_t    m_playlists;
+  mutable std::string m_serialized;
 };
 
 // ----------------------------------------------------------------------------
-static inline json::value to_json(const track_t& track)
+namespace json
 {
-  json::object o {
-    { "track_id", track.track_id() },
-    { "title", track.title() },
-    { "track_number", track.track_number() },
-    { "duration", track.duration() },
-    { "rating", track.rating() },
-    { "artist", track.artist() },
-    { "album", track.album() },
-    { "album_id", track.album_id() }
+  template <> struct fields<track_t>
+  {
+    template <class V> static void each(V&& v)
+    {
+      v(keys::track_id, &track_t::track_id);
+      v(keys::title, &track_t::title);
+      v(keys::track_number, &track_t::track_number);
+      v(keys::duration, &track_t::duration);
+      v(keys::rating, &track_t::rating);
+      v(keys::artist, &track_t::artist);
+      v(keys::album, &track_t::album);
+      v(keys::album_id, &track_t::album_id);
+      v(keys::playlists, &track_t::playlists);
+    }
   };
+}
 
-  json::array playlists;
-  for ( const auto& pl : track.playlists() ) {
-    playlists.push_back(pl);
+// ----------------------------------------------------------------------------
+inline const std::string& track_t::serialized() const
+{
+  if ( m_serialized.empty() ) {
+    m_serialized = json::serialize(*this);
   }
+  return m_serialized;
+}
 
-  o["playlists"] = playlists;
-
-  return std::move(o);
+// ----------------------------------------------------------------------------
+static inline json::value to_json(const track_t& track)
+{
+  return json::value::raw(track.serialized());
 }
 
 // ----------------------------------------------------------------------------
@@ -29,33 +29,6 @@ void track_stat_t::increase_skip_count()
     m_rating *= 0.9;
 }
 
-// ---------------------------------------------------------------------------
-track_stat_t track_stat_t::from_json(json::object& object)
-{
-    if ( !object["track_id"].is_string() ) {
-        throw std::runtime_error("track stat track_id must be a string!");
-    }
-
-    if ( !object["play_count"].is_number() ) {
-        throw std::runtime_error("track stat play_count must be a number!");
-    }
-
-    if ( !object["skip_count"].is_number() ) {
-        throw std::runtime_error("track stat skip_count must be a number!");
-    }
-
-    if ( !object["rating"].is_number() ) {
-        throw std::runtime_error("track stat rating must be a number!");
-    }
-
-    return track_stat_t{
-        object["track_id"].as_string(),
-        unsigned(object["play_count"].as_number()),
-        unsigned(object["skip_count"].as_number()),
-        object["rating"].as_number()
-    };
-}
-
 // ---------------------------------------------------------------------------
 void load_track_stats(track_stat_map_t& map, const std::string& filename)
 {
@@ -67,24 +40,32 @@ void load_track_stats(track_stat_map_t& map, const std::string& filename)
 
   std::string str((std::istreambuf_iterator<char>(f)), std::istreambuf_iterator<char>());
 
-  json::value  doc;
-  json::parser parser(doc);
+  // Only index the file, members are decoded straight into the stats. The
+  // document refers to str.
+  json::document doc;
 
-  parser.parse(str.c_str(), str.length());
+  try
+  {
+    doc.parse(str.data(), str.length());
 
-  if ( !doc.is_array() ) {
-    throw std::runtime_error("track stat file must be a json array!");
-  }
+    json::element root = doc.root();
 
-  for ( auto& ts : doc.as_array() )
-  {
-    if ( !ts.is_object() ) {
-        throw std::runtime_error("track stat must a json object!");
+    if ( !root.is_array() ) {
+      throw std::runtime_error("track stat file must be a json array!");
     }
 
-    track_stat_t track_stat = track_stat_t::from_json(ts.as_object());
+    for ( auto ts : root )
+    {
+      track_stat_t track_stat;
+      json::read_fields(ts, track_stat);
 
-    map[track_stat.track_id()] = track_stat;
+      std::string track_id = track_stat.track_id();
+      map[std::move(track_id)] = std::move(track_stat);
+    }
+  }
+  catch (const std::exception& e)
+  {
+    throw std::runtime_error(std::string("track stat file error - ") + e.what());
   }
 }
 
@@ -97,12 +78,22 @@ void save_track_stats(track_stat_map_t& map, const std::string& filename)
     throw std::runtime_error("failed to open track stat file!");
   }
 
-  json::array track_stats;
-  for ( auto& ts : map ) {
-    track_stats.push_back(to_json(ts.second));
+  std::string buffer;
+  json::writer writer(buffer);
+
+  buffer.reserve(map.size()*96);
+
+  writer.put('[');
+  for ( auto& ts : map )
+  {
+    if ( buffer.size() > 1 ) {
+      writer.put(',');
+    }
+    json::write_fields(writer, ts.second);
   }
+  writer.put(']');
 
-  f << track_stats;
+  f.write(buffer.data(), buffer.size());
 
   f.close();
 }
\ No newline at end of file
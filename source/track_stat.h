@@ -50,6 +50,9 @@ public:
   }
 public:
   void track_id(std::string track_id)         { m_track_id = std::move(track_id); }
+  void play_count(unsigned play_count)        { m_play_count = play_count; }
+  void skip_count(unsigned skip_count)        { m_skip_count = skip_count; }
+  void rating(double rating)                  { m_rating = rating; }
 public:
   void increase_play_count();
   void increase_skip_count();
@@ -58,8 +61,6 @@ public:
   unsigned           play_count() const       { return m_play_count; }
   unsigned           skip_count() const       { return m_skip_count; }
   double             rating()     const       { return m_rating; }
-public:
-  static track_stat_t from_json(json::object& object);
 private:
   std::string m_track_id;
   unsigned    m_play_count;
@@ -68,16 +69,24 @@ private:
 };
 
 // ----------------------------------------------------------------------------
-static inline json::value to_json(const track_stat_t& track_stat)
+namespace json
 {
-  json::object o {
-    { "track_id", track_stat.track_id() },
-    { "play_count", track_stat.play_count() },
-    { "skip_count", track_stat.skip_count() },
-    { "rating", track_stat.rating() }
+  template <> struct fields<track_stat_t>
+  {
+    template <class V> static void each(V&& v)
+    {
+      v(keys::track_id, &track_stat_t::track_id, &track_stat_t::track_id);
+      v(keys::play_count, &track_stat_t::play_count, &track_stat_t::play_count);
+      v(keys::skip_count, &track_stat_t::skip_count, &track_stat_t::skip_count);
+      v(keys::rating, &track_stat_t::rating, &track_stat_t::rating);
+    }
   };
+}
 
-  return std::move(o);
+// ----------------------------------------------------------------------------
+static inline json::value to_json(const track_stat_t& track_stat)
+{
+  return json::value::raw(json::serialize(track_stat));
 }
 
 // ----------------------------------------------------------------------------